@@ -6,8 +6,14 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define DEFAULT_PORT 2012
 #define DEFAULT_RATE_MSGS 3
@@ -17,6 +23,18 @@
 #define BUFFER_SIZE 100000 // Increased buffer size
 #define LOG_FILE "server_log.txt"
 #define MAX_FILE_SIZE 1000000 // Maximum file size (1MB)
+#define DEFAULT_SNAPSHOT_INTERVAL 30 // Seconds between warm-start snapshots
+#define DRAIN_TIMEOUT 30 // Seconds to let in-flight requests finish on shutdown
+#define MAX_TRACKED_CHILDREN 1024
+#define SNAPSHOT_FILE "qr_snapshot.bin"
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP"
+#define SNAPSHOT_VERSION 2 // Bump whenever the Snapshot layout changes
+#define MAX_CLIENTS 256
+#define DECODE_CACHE_SLOTS 128
+#define DECODE_URL_SIZE 1024
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define SHA256_DIGEST_SIZE 32
 
 #define CODE_SUCCESS 0
 #define CODE_FAILURE 1
@@ -28,10 +46,59 @@ typedef struct {
     char client_ip[INET_ADDRSTRLEN];
     time_t last_request_time;
     int request_count;
-    int is_connected; // Track if client is connected
+    int connections; // Active connections from this IP
 } ClientInfo;
 
-ClientInfo client_info_map[256];
+// Keyed on SHA-256 because entries are shared across clients and persisted,
+// so a forged collision must not be able to redirect someone else's image
+typedef struct {
+    uint8_t image_digest[SHA256_DIGEST_SIZE];
+    uint64_t image_size;
+    time_t last_used;
+    char url[DECODE_URL_SIZE];
+} DecodeCacheEntry;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    uint8_t block[64];
+    size_t block_len;
+} Sha256Context;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t client_slots;
+    uint32_t client_record_size;
+    uint32_t cache_slots;
+    uint32_t cache_record_size;
+    int64_t saved_at;
+    uint64_t checksum; // FNV-1a of everything after the header
+} SnapshotHeader;
+
+// On-disk snapshot layout. The file is a byte-for-byte copy of this struct so
+// it can be mapped and used directly on startup.
+typedef struct {
+    SnapshotHeader header;
+    ClientInfo clients[MAX_CLIENTS];
+    DecodeCacheEntry cache[DECODE_CACHE_SLOTS];
+} Snapshot;
+
+// Mapped MAP_SHARED before any fork so every client process sees the same tables
+typedef struct {
+    pthread_mutex_t lock;
+    int connected_users; // Live connections, not persisted
+    volatile int draining; // Set by the parent on SIGTERM/SIGINT
+    Snapshot snapshot;
+} SharedState;
+
+SharedState *shared_state;
+ClientInfo *client_info_map;
+DecodeCacheEntry *decode_cache;
+Snapshot snapshot_buffer; // Staging copy written out by write_snapshot()
+
+volatile sig_atomic_t shutdown_requested = 0; // Number of SIGTERM/SIGINT received
+pid_t client_pids[MAX_TRACKED_CHILDREN]; // Client processes, each leading its own process group
 
 const char* timestamp() {
     time_t now = time(NULL);
@@ -41,63 +108,402 @@ const char* timestamp() {
     return buffer;
 }
 
-// Global variable for shared memory ID
-int shmid;
 FILE *log_file;
 
-void create_shared_memory() {
-    // Create the shared memory segment
-    if ((shmid = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | 0666)) < 0) {
-        perror("shmget");
-        exit(EXIT_FAILURE);
+void reset_client_info(ClientInfo *client_info) {
+    client_info->last_request_time = time(NULL);
+    client_info->request_count = 0;
+}
+
+uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
     }
+    return hash;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_transform(Sha256Context *ctx, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16
+             | (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
 
-    // Initialize connected_users
-    int* shared_memory = (int *) shmat(shmid, NULL, 0);
-    if (shared_memory == (int *) -1) {
-        perror("shmat");
+void sha256_init(Sha256Context *ctx) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(Sha256Context *ctx, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    ctx->length += len;
+    while (len > 0) {
+        size_t chunk = sizeof(ctx->block) - ctx->block_len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(ctx->block + ctx->block_len, bytes, chunk);
+        ctx->block_len += chunk;
+        bytes += chunk;
+        len -= chunk;
+        if (ctx->block_len == sizeof(ctx->block)) {
+            sha256_transform(ctx, ctx->block);
+            ctx->block_len = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256Context *ctx, uint8_t *digest) {
+    uint64_t bit_length = ctx->length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t pad_len = (ctx->block_len < 56 ? 56 : 120) - ctx->block_len;
+    for (int i = 0; i < 8; i++) {
+        padding[pad_len + i] = (uint8_t) (bit_length >> (56 - i * 8));
+    }
+    sha256_update(ctx, padding, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+void create_shared_state() {
+    shared_state = mmap(NULL, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_state == MAP_FAILED) {
+        perror("mmap");
         exit(EXIT_FAILURE);
     }
-    *shared_memory = 0; // Initialize connected_users
-    if (shmdt(shared_memory) == -1) {
-        perror("shmdt");
+
+    // Robust so a client killed mid-update (e.g. by SIGKILL) cannot wedge the server
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&shared_state->lock, &attr) != 0) {
+        perror("pthread_mutex_init");
         exit(EXIT_FAILURE);
     }
+    pthread_mutexattr_destroy(&attr);
+
+    client_info_map = shared_state->snapshot.clients;
+    decode_cache = shared_state->snapshot.cache;
 }
 
-void attach_shared_memory(int** shared_memory) {
-    *shared_memory = (int *) shmat(shmid, NULL, 0);
-    if (*shared_memory == (int *) -1) {
-        perror("shmat");
-        exit(EXIT_FAILURE);
+void lock_shared_state() {
+    if (pthread_mutex_lock(&shared_state->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared_state->lock);
     }
 }
 
-void detach_shared_memory(int* shared_memory) {
-    if (shmdt(shared_memory) == -1) {
-        perror("shmdt");
-        exit(EXIT_FAILURE);
+void unlock_shared_state() {
+    pthread_mutex_unlock(&shared_state->lock);
+}
+
+// Caller must hold the shared state lock. When the table is full the entry
+// with no active connections and the oldest request is reused.
+ClientInfo *find_client_info(const char *client_ip) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (strcmp(client_info_map[i].client_ip, client_ip) == 0) {
+            return &client_info_map[i];
+        }
+    }
+
+    ClientInfo *slot = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientInfo *candidate = &client_info_map[i];
+        if (candidate->client_ip[0] == '\0') {
+            slot = candidate;
+            break;
+        }
+        if (candidate->connections == 0 && (!slot || candidate->last_request_time < slot->last_request_time)) {
+            slot = candidate;
+        }
     }
+
+    if (slot) {
+        strcpy(slot->client_ip, client_ip);
+        slot->last_request_time = time(NULL);
+        slot->request_count = 0;
+        slot->connections = 0;
+    }
+    return slot;
 }
 
-void increment_connected_users() {
-    int* shared_memory;
-    attach_shared_memory(&shared_memory);
-    (*shared_memory)++;
-    detach_shared_memory(shared_memory);
+void touch_client_info(const char *client_ip) {
+    lock_shared_state();
+    ClientInfo *client_info = find_client_info(client_ip);
+    if (client_info) {
+        client_info->last_request_time = time(NULL);
+    }
+    unlock_shared_state();
 }
 
-void decrement_connected_users() {
-    int* shared_memory;
-    attach_shared_memory(&shared_memory);
-    (*shared_memory)--;
-    detach_shared_memory(shared_memory);
+int decode_cache_lookup(const uint8_t *image_digest, uint64_t image_size, char *url) {
+    int found = 0;
+    lock_shared_state();
+    for (int i = 0; i < DECODE_CACHE_SLOTS; i++) {
+        DecodeCacheEntry *entry = &decode_cache[i];
+        if (entry->url[0] != '\0' && entry->image_size == image_size && memcmp(entry->image_digest, image_digest, SHA256_DIGEST_SIZE) == 0) {
+            entry->last_used = time(NULL);
+            strcpy(url, entry->url);
+            found = 1;
+            break;
+        }
+    }
+    unlock_shared_state();
+    return found;
 }
 
-void reset_client_info(ClientInfo *client_info) {
-    client_info->last_request_time = time(NULL);
-    client_info->request_count = 0;
-    client_info->is_connected = 0; // Reset is_connected flag
+void decode_cache_store(const uint8_t *image_digest, uint64_t image_size, const char *url) {
+    if (strlen(url) >= DECODE_URL_SIZE) {
+        return;
+    }
+
+    lock_shared_state();
+    // Reuse the matching entry, then an empty one, then the least recently used
+    DecodeCacheEntry *slot = &decode_cache[0];
+    for (int i = 0; i < DECODE_CACHE_SLOTS; i++) {
+        DecodeCacheEntry *entry = &decode_cache[i];
+        if (entry->url[0] != '\0' && entry->image_size == image_size && memcmp(entry->image_digest, image_digest, SHA256_DIGEST_SIZE) == 0) {
+            slot = entry;
+            break;
+        }
+        if (slot->url[0] != '\0' && (entry->url[0] == '\0' || entry->last_used < slot->last_used)) {
+            slot = entry;
+        }
+    }
+    memcpy(slot->image_digest, image_digest, SHA256_DIGEST_SIZE);
+    slot->image_size = image_size;
+    slot->last_used = time(NULL);
+    strcpy(slot->url, url);
+    unlock_shared_state();
+}
+
+void fill_snapshot_header(SnapshotHeader *header) {
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->client_slots = MAX_CLIENTS;
+    header->client_record_size = sizeof(ClientInfo);
+    header->cache_slots = DECODE_CACHE_SLOTS;
+    header->cache_record_size = sizeof(DecodeCacheEntry);
+}
+
+uint64_t snapshot_checksum(const Snapshot *snapshot) {
+    const char *body = (const char *) snapshot + sizeof(SnapshotHeader);
+    return fnv1a_update(FNV_OFFSET_BASIS, body, sizeof(Snapshot) - sizeof(SnapshotHeader));
+}
+
+// Maps the snapshot file and adopts it as the live tables. Returns 1 on a warm start.
+int load_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != (off_t) sizeof(Snapshot)) {
+        fprintf(stderr, "Ignoring snapshot %s: unexpected size\n", path);
+        close(fd);
+        return 0;
+    }
+
+    const Snapshot *mapped = mmap(NULL, sizeof(Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("Error mapping snapshot");
+        return 0;
+    }
+
+    SnapshotHeader expected;
+    fill_snapshot_header(&expected);
+    const SnapshotHeader *header = &mapped->header;
+    int valid = header->magic == expected.magic
+        && header->version == expected.version
+        && header->client_slots == expected.client_slots
+        && header->client_record_size == expected.client_record_size
+        && header->cache_slots == expected.cache_slots
+        && header->cache_record_size == expected.cache_record_size
+        && header->checksum == snapshot_checksum(mapped);
+
+    if (valid) {
+        memcpy(&shared_state->snapshot, mapped, sizeof(Snapshot));
+        // Connections do not survive a restart
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_info_map[i].connections = 0;
+        }
+    } else {
+        fprintf(stderr, "Ignoring snapshot %s: incompatible version or corrupt\n", path);
+    }
+
+    munmap((void *) mapped, sizeof(Snapshot));
+    return valid;
+}
+
+// Writes to a temporary file and renames it so a crash never leaves a torn snapshot
+int write_snapshot(const char *path) {
+    lock_shared_state();
+    memcpy(&snapshot_buffer, &shared_state->snapshot, sizeof(Snapshot));
+    unlock_shared_state();
+
+    fill_snapshot_header(&snapshot_buffer.header);
+    snapshot_buffer.header.saved_at = time(NULL);
+    snapshot_buffer.header.checksum = snapshot_checksum(&snapshot_buffer);
+
+    char temp_path[256];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating snapshot file");
+        return -1;
+    }
+
+    const char *data = (const char *) &snapshot_buffer;
+    size_t written = 0;
+    while (written < sizeof(Snapshot)) {
+        ssize_t n = write(fd, data + written, sizeof(Snapshot) - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing snapshot file");
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        written += n;
+    }
+
+    if (fsync(fd) < 0) {
+        perror("Error syncing snapshot file");
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(temp_path, path) < 0) {
+        perror("Error renaming snapshot file");
+        unlink(temp_path);
+        return -1;
+    }
+
+    // The rename itself is only durable once the containing directory is synced
+    char dir_path[256];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    char *slash = strrchr(dir_path, '/');
+    if (slash) {
+        *(slash == dir_path ? slash + 1 : slash) = '\0';
+    } else {
+        strcpy(dir_path, ".");
+    }
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) < 0) {
+        perror("Error syncing snapshot directory");
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return -1;
+    }
+    close(dir_fd);
+    return 0;
+}
+
+void handle_shutdown_signal(int signo) {
+    (void) signo;
+    shutdown_requested++;
+}
+
+int track_child(pid_t pid) {
+    for (int i = 0; i < MAX_TRACKED_CHILDREN; i++) {
+        if (client_pids[i] == 0) {
+            client_pids[i] = pid;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reaps finished client processes and returns how many are still running
+int reap_children() {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_TRACKED_CHILDREN; i++) {
+            if (client_pids[i] == pid) {
+                client_pids[i] = 0;
+                break;
+            }
+        }
+    }
+
+    int running = 0;
+    for (int i = 0; i < MAX_TRACKED_CHILDREN; i++) {
+        if (client_pids[i] != 0) {
+            running++;
+        }
+    }
+    return running;
+}
+
+// Kills every remaining client together with any ZXing process it started
+void kill_children() {
+    for (int i = 0; i < MAX_TRACKED_CHILDREN; i++) {
+        if (client_pids[i] != 0) {
+            kill(-client_pids[i], SIGKILL);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    memset(client_pids, 0, sizeof(client_pids));
 }
 
 void handle_timeout(int client_socket) {
@@ -125,15 +531,27 @@ void send_server_message(int client_socket, int return_code, const char *url) {
     }
 }
 
-void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout, int max_users, int server_socket, size_t max_file_size) {
+pid_t handle_client(int client_socket, int rate_msgs, int rate_time, int timeout, int max_users, int server_socket, size_t max_file_size) {
     pid_t pid = fork();
 
     if (pid < 0) {
         perror("Error forking process");
         close(client_socket);
-        return;
+        return pid;
     } else if (pid == 0) {
         close(server_socket);
+        // Own process group so the parent can kill this client and its ZXing run together
+        setpgid(0, 0);
+        // The parent coordinates shutdown through shared_state->draining so an
+        // in-flight decode is allowed to finish, even when CTRL+C reaches the
+        // whole process group
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        sigset_t shutdown_signals;
+        sigemptyset(&shutdown_signals);
+        sigaddset(&shutdown_signals, SIGTERM);
+        sigaddset(&shutdown_signals, SIGINT);
+        sigprocmask(SIG_UNBLOCK, &shutdown_signals, NULL);
 
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
@@ -141,39 +559,37 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
 
+        // Bound every recv so a stalled client cannot hold up a drain forever
+        struct timeval recv_timeout = { timeout, 0 };
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+
         time_t last_interaction_time = time(NULL);
 
-        // Check if the number of connected users has exceeded the max_users limit
-        int* connected_users;
+        ClientInfo *client_info = NULL;
+        int counted = 0;
+        int quit = 0;
 
         while (1) {
-            attach_shared_memory(&connected_users);
-
-            printf("Connected Users: %d\n", *connected_users);
-            fprintf(log_file, "%s Connected Users: %d\n", timestamp(), *connected_users);
-
-            ClientInfo *client_info = NULL;
-            for (int i = 0; i < 256; i++) {
-                if (strcmp(client_info_map[i].client_ip, client_ip) == 0) {
-                    client_info = &client_info_map[i];
-                    break;
-                }
-            }
-            if (!client_info) {
-                for (int i = 0; i < 256; i++) {
-                    if (client_info_map[i].client_ip[0] == '\0') {
-                        client_info = &client_info_map[i];
-                        strcpy(client_info->client_ip, client_ip);
-                        client_info->last_request_time = time(NULL);
-                        client_info->request_count = 0;
-                        client_info->is_connected = 1; // Mark as connected
-                        (*connected_users)++; // Increment connected users count
-                        break;
-                    }
+            lock_shared_state();
+            printf("Connected Users: %d\n", shared_state->connected_users);
+            fprintf(log_file, "%s Connected Users: %d\n", timestamp(), shared_state->connected_users);
+
+            // The rate-limit table is shared across connections, so count this connection once.
+            // Holding a connection on the entry also keeps it from being evicted.
+            if (!counted) {
+                client_info = find_client_info(client_ip);
+                if (client_info) {
+                    client_info->connections++;
+                    shared_state->connected_users++; // Increment connected users count
+                    counted = 1;
                 }
             }
 
-            if (*connected_users > max_users) {
+            // Check if the number of connected users has exceeded the max_users limit
+            int server_busy = !counted || shared_state->connected_users > max_users;
+            unlock_shared_state();
+
+            if (server_busy) {
                 printf("SENDING BUSY SERVER MESSAGE\n");
                 fprintf(log_file, "%s SENDING BUSY SERVER MESSAGE\n", timestamp());
                 // Server busy, send error message to client
@@ -184,7 +600,6 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
                 break;
             }
 
-            detach_shared_memory(connected_users);
             time_t current_time = time(NULL);
             time_t elapsed_time = current_time - last_interaction_time;
 
@@ -193,12 +608,25 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
                 break;
             }
 
-            fd_set read_fds;
-            FD_ZERO(&read_fds);
-            FD_SET(client_socket, &read_fds);
-            struct timeval tv = { timeout, 0 };
-            int select_ret = select(client_socket + 1, &read_fds, NULL, NULL, &tv);
-            if (select_ret == 0) {
+            // Wait in one second slices so a draining server is noticed while the client is idle
+            int select_ret = 0;
+            while (!shared_state->draining && time(NULL) - current_time < timeout) {
+                fd_set read_fds;
+                FD_ZERO(&read_fds);
+                FD_SET(client_socket, &read_fds);
+                struct timeval tv = { 1, 0 };
+                select_ret = select(client_socket + 1, &read_fds, NULL, NULL, &tv);
+                if (select_ret != 0) {
+                    break;
+                }
+            }
+            if (select_ret == 0 && shared_state->draining) {
+                int server_busy_code = CODE_SERVER_BUSY;
+                send(client_socket, &server_busy_code, sizeof(server_busy_code), 0);
+                printf("Server shutting down. Connection from %s:%d closed.\n", client_ip, ntohs(client_addr.sin_port));
+                fprintf(log_file, "%s Server shutting down. Connection from %s:%d closed.\n", timestamp(), client_ip, ntohs(client_addr.sin_port));
+                break;
+            } else if (select_ret == 0) {
                 handle_timeout(client_socket);
                 break;
             } else if (select_ret < 0) {
@@ -206,23 +634,11 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
                 break;
             }
 
-            for (int i = 0; i < 256; i++) {
-                if (strcmp(client_info_map[i].client_ip, client_ip) == 0) {
-                    client_info = &client_info_map[i];
-                    break;
-                }
-            }
+            lock_shared_state();
+            client_info = find_client_info(client_ip);
             if (!client_info) {
-                for (int i = 0; i < 256; i++) {
-                    if (client_info_map[i].client_ip[0] == '\0') {
-                        client_info = &client_info_map[i];
-                        strcpy(client_info->client_ip, client_ip);
-                        client_info->last_request_time = time(NULL);
-                        client_info->request_count = 0;
-                        client_info->is_connected = 1; // Mark as connected
-                        break;
-                    }
-                }
+                unlock_shared_state();
+                break;
             }
 
             if (current_time - client_info->last_request_time > rate_time) {
@@ -231,53 +647,81 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
             }
 
             client_info->request_count++;
+            int rate_limited = client_info->request_count > rate_msgs;
+            unlock_shared_state();
 
-            if (client_info->request_count > rate_msgs) {
+            if (rate_limited) {
                 int rate_limit_exceeded_code = CODE_RATE_LIMIT_EXCEEDED;
                 send(client_socket, &rate_limit_exceeded_code, sizeof(rate_limit_exceeded_code), 0);
-                sleep(rate_time);
-                client_info->request_count = 0;
+                for (int waited = 0; waited < rate_time && !shared_state->draining; waited++) {
+                    sleep(1);
+                }
+                lock_shared_state();
+                client_info = find_client_info(client_ip);
+                if (client_info) {
+                    client_info->request_count = 0;
+                }
+                unlock_shared_state();
                 continue;
             }
 
             size_t image_size;
-            if (recv(client_socket, &image_size, sizeof(size_t), 0) < 0) {
+            ssize_t size_received = recv(client_socket, &image_size, sizeof(size_t), 0);
+            if (size_received < 0) {
                 perror("Error receiving image size");
                 break;
-            } 
+            } else if (size_received == 0) {
+                printf("%s:%d closed the connection.\n", client_ip, ntohs(client_addr.sin_port));
+                fprintf(log_file, "%s %s:%d closed the connection.\n", timestamp(), client_ip, ntohs(client_addr.sin_port));
+                break;
+            }
 
             printf("Received image size: %zu bytes\n", image_size);
             fprintf(log_file, "%s Received image size: %zu bytes\n", timestamp(), image_size);
 
             if (image_size == 1) {
                 char quit_message;
-                if (recv(client_socket, &quit_message, sizeof(char), 0) < 0) {
+                if (recv(client_socket, &quit_message, sizeof(char), 0) <= 0) {
                     perror("Error receiving quit message");
                     break;
                 }
                 if (quit_message == 'q') {
                     printf("%s:%d has disconnected.\n", client_ip, ntohs(client_addr.sin_port));
                     fprintf(log_file, "%s %s:%d has disconnected.\n", timestamp(), client_ip, ntohs(client_addr.sin_port));
-                    reset_client_info(client_info);
+                    quit = 1;
                     break;
                 }
             }
 
             char buffer[BUFFER_SIZE];
             size_t total_bytes_received = 0;
+            Sha256Context image_hash;
+            sha256_init(&image_hash);
 
-            char temp_file_path[] = "/tmp/qrcode_image.png";
-            FILE *image_file = fopen(temp_file_path, "wb+");
+            // Each client gets its own file so the decoded URL always belongs to the hashed bytes
+            char temp_file_path[] = "/tmp/qrcode_XXXXXX.png";
+            int image_fd = mkstemps(temp_file_path, 4);
+            FILE *image_file = image_fd < 0 ? NULL : fdopen(image_fd, "wb+");
             if (!image_file) {
                 perror("Error creating temporary file");
+                if (image_fd >= 0) {
+                    close(image_fd);
+                    unlink(temp_file_path);
+                }
                 break;
             }
 
+            int disconnected = 0;
             while (total_bytes_received < image_size) {
                 ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
                 if (bytes_received < 0) {
                     perror("Error receiving image data");
-                    fclose(image_file);
+                    disconnected = 1;
+                    break;
+                } else if (bytes_received == 0) {
+                    printf("%s:%d closed the connection mid-upload.\n", client_ip, ntohs(client_addr.sin_port));
+                    fprintf(log_file, "%s %s:%d closed the connection mid-upload.\n", timestamp(), client_ip, ntohs(client_addr.sin_port));
+                    disconnected = 1;
                     break;
                 }
 
@@ -285,25 +729,44 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
                 if (total_bytes_received + bytes_received > max_file_size) {
                     printf("Exceeded maximum file size\n");
                     fprintf(log_file, "%s Exceeded maximum file size\n", timestamp());
-                    fclose(image_file);
-                    remove(temp_file_path); // Delete the incomplete file
+                    unlink(temp_file_path); // Delete the incomplete file
                     break;
                 }
 
                 fwrite(buffer, 1, bytes_received, image_file);
+                sha256_update(&image_hash, buffer, bytes_received);
                 total_bytes_received += bytes_received;
             }
 
             fclose(image_file);
+            if (disconnected) {
+                unlink(temp_file_path);
+                break;
+            }
             printf("Image reception completed\n");
             fprintf(log_file, "%s Image reception completed\n", timestamp());
 
+            // Only complete images are cached, keyed by content digest and size
+            int image_complete = total_bytes_received == image_size;
+            uint8_t image_digest[SHA256_DIGEST_SIZE];
+            sha256_final(&image_hash, image_digest);
+            char cached_url[DECODE_URL_SIZE];
+            if (image_complete && decode_cache_lookup(image_digest, image_size, cached_url)) {
+                printf("Decode cache hit, skipping ZXing\n");
+                fprintf(log_file, "%s Decode cache hit, skipping ZXing\n", timestamp());
+                send_server_message(client_socket, CODE_SUCCESS, cached_url);
+                unlink(temp_file_path);
+                touch_client_info(client_ip);
+                continue;
+            }
+
             char command[512];
             snprintf(command, sizeof(command), "java -cp javase.jar:core.jar com.google.zxing.client.j2se.CommandLineRunner %s", temp_file_path);
 
             FILE *zxing_output = popen(command, "r");
             if (!zxing_output) {
                 perror("Error running ZXing");
+                unlink(temp_file_path);
                 break;
             }
 
@@ -324,6 +787,7 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
             }
 
             pclose(zxing_output);
+            unlink(temp_file_path);
 
             if (zxing_result == NULL) {
                 perror("Error reading ZXing output");
@@ -338,9 +802,10 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
                     char *url_end = strchr(url_start, '\n');
                     if (url_end!= NULL) {
                         *url_end = '\0';
-                        if (client_info->request_count <= rate_msgs) {
-                            send_server_message(client_socket, CODE_SUCCESS, url_start);
+                        if (image_complete) {
+                            decode_cache_store(image_digest, image_size, url_start);
                         }
+                        send_server_message(client_socket, CODE_SUCCESS, url_start);
                     }
                 } else {
                     printf("URL not found in ZXing output\n");
@@ -353,19 +818,30 @@ void handle_client(int client_socket, int rate_msgs, int rate_time, int timeout,
 
             free(zxing_result);
 
-            client_info->last_request_time = time(NULL);
+            touch_client_info(client_ip);
         }
 
         // Decrement connected users count only if the client was connected
-        attach_shared_memory(&connected_users);
-        if (*connected_users > 0) {
-            (*connected_users)--;
+        if (counted) {
+            lock_shared_state();
+            client_info = find_client_info(client_ip);
+            if (client_info && client_info->connections > 0) {
+                client_info->connections--;
+                // A quit only clears the rate limit once no other connection from this IP remains
+                if (quit && client_info->connections == 0) {
+                    reset_client_info(client_info);
+                }
+            }
+            if (shared_state->connected_users > 0) {
+                shared_state->connected_users--;
+            }
+            unlock_shared_state();
         }
-        detach_shared_memory(connected_users);
 
         exit(EXIT_SUCCESS);
     } else {
-        return;
+        setpgid(pid, pid);
+        return pid;
     }
 }
 
@@ -375,6 +851,7 @@ int main(int argc, char *argv[]) {
     int rate_time = DEFAULT_RATE_TIME;
     int max_users = DEFAULT_MAX_USERS;
     int timeout = DEFAULT_TIMEOUT;
+    int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-PORT") == 0) {
@@ -410,9 +887,16 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Option -TIME_OUT requires an argument.\n");
                 exit(EXIT_FAILURE);
             }
+        } else if (strcmp(argv[i], "-SNAPSHOT_INTERVAL") == 0) {
+            if (i + 1 < argc) {
+                snapshot_interval = atoi(argv[++i]);
+            } else {
+                fprintf(stderr, "Option -SNAPSHOT_INTERVAL requires an argument.\n");
+                exit(EXIT_FAILURE);
+            }
         } else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
-            fprintf(stderr, "Usage: %s -PORT [port] -RATE [msgs] [seconds] -MAX_USERS [users] -TIME_OUT [timeout]\n", argv[0]);
+            fprintf(stderr, "Usage: %s -PORT [port] -RATE [msgs] [seconds] -MAX_USERS [users] -TIME_OUT [timeout] -SNAPSHOT_INTERVAL [seconds]\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
@@ -422,6 +906,7 @@ int main(int argc, char *argv[]) {
     printf("Rate time: %d\n", rate_time);
     printf("Max users: %d\n", max_users);
     printf("Timeout: %d\n", timeout);
+    printf("Snapshot interval: %d\n", snapshot_interval);
 
     log_file = fopen(LOG_FILE, "a");
     if (!log_file) {
@@ -431,7 +916,32 @@ int main(int argc, char *argv[]) {
 
     fprintf(log_file, "%s Server listening on port %d...\n", timestamp(), port);
 
-    create_shared_memory();
+    create_shared_state();
+
+    if (load_snapshot(SNAPSHOT_FILE)) {
+        printf("Warm start from %s\n", SNAPSHOT_FILE);
+        fprintf(log_file, "%s Warm start from %s\n", timestamp(), SNAPSHOT_FILE);
+    } else {
+        printf("Cold start, no usable snapshot\n");
+        fprintf(log_file, "%s Cold start, no usable snapshot\n", timestamp());
+    }
+
+    // Shutdown signals stay blocked except inside pselect(), so one arriving
+    // between the shutdown_requested check and the wait cannot be missed
+    struct sigaction shutdown_action;
+    memset(&shutdown_action, 0, sizeof(shutdown_action));
+    shutdown_action.sa_handler = handle_shutdown_signal;
+    sigemptyset(&shutdown_action.sa_mask);
+    sigaddset(&shutdown_action.sa_mask, SIGTERM);
+    sigaddset(&shutdown_action.sa_mask, SIGINT);
+    sigaction(SIGTERM, &shutdown_action, NULL);
+    sigaction(SIGINT, &shutdown_action, NULL);
+
+    sigset_t shutdown_signals, original_mask;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGTERM);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &shutdown_signals, &original_mask);
 
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
@@ -456,7 +966,27 @@ int main(int argc, char *argv[]) {
 
     fprintf(log_file, "%s Server listening on port %d...\n", timestamp(), port);
 
-    while (1) {
+    time_t next_snapshot = time(NULL) + snapshot_interval;
+    while (!shutdown_requested) {
+        reap_children();
+        time_t now = time(NULL);
+        if (snapshot_interval > 0 && now >= next_snapshot) {
+            write_snapshot(SNAPSHOT_FILE);
+            next_snapshot = now + snapshot_interval;
+        }
+
+        fd_set accept_fds;
+        FD_ZERO(&accept_fds);
+        FD_SET(server_socket, &accept_fds);
+        struct timespec ts = { next_snapshot > now ? next_snapshot - now : 1, 0 };
+        int ready = pselect(server_socket + 1, &accept_fds, NULL, NULL, snapshot_interval > 0 ? &ts : NULL, &original_mask);
+        if (ready < 0 && errno != EINTR) {
+            perror("Error waiting for connection");
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
         int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_socket < 0) {
             perror("Error in accepting connection");
@@ -466,10 +996,43 @@ int main(int argc, char *argv[]) {
         printf("New connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
         fprintf(log_file, "%s New connection accepted from %s:%d\n", timestamp(), inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-        handle_client(client_socket, rate_msgs, rate_time, timeout, max_users, server_socket, MAX_FILE_SIZE);
+        // Every client must be tracked so a stuck one can be killed on shutdown
+        if (reap_children() >= MAX_TRACKED_CHILDREN) {
+            int server_busy_code = CODE_SERVER_BUSY;
+            send(client_socket, &server_busy_code, sizeof(server_busy_code), 0);
+            close(client_socket);
+            continue;
+        }
+
+        pid_t pid = handle_client(client_socket, rate_msgs, rate_time, timeout, max_users, server_socket, MAX_FILE_SIZE);
+        if (pid > 0) {
+            track_child(pid);
+            close(client_socket);
+        }
     }
 
+    printf("Shutting down, draining in-flight requests...\n");
+    fprintf(log_file, "%s Shutting down, draining in-flight requests...\n", timestamp());
+    shared_state->draining = 1;
     close(server_socket);
+
+    // A second SIGTERM/SIGINT cuts the drain short; stragglers are killed either way
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+    time_t drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+    while (reap_children() > 0 && shutdown_requested < 2 && time(NULL) < drain_deadline) {
+        sleep(1);
+    }
+    if (reap_children() > 0) {
+        printf("Killing clients that did not finish in time\n");
+        fprintf(log_file, "%s Killing clients that did not finish in time\n", timestamp());
+        kill_children();
+    }
+
+    if (write_snapshot(SNAPSHOT_FILE) == 0) {
+        printf("Final snapshot written to %s\n", SNAPSHOT_FILE);
+        fprintf(log_file, "%s Final snapshot written to %s\n", timestamp(), SNAPSHOT_FILE);
+    }
+
     fclose(log_file);
 
     return 0;